@@ -4,9 +4,14 @@
 #define MESSAGE_LOGGER_PATH                    "/var/lib/battery.log"
 #define DATA_LOGGER_PATH                       "/var/lib/battery_data.csv"
 #define SHM_BACKUP                             "/var/lib/battery_shm"
+#define SHUTDOWN_STATE_PATH                    "/var/lib/battery_shutdown"
+#define HISTORY_PATH                           "/var/lib/battery_history"
+#define LEDGER_PATH                            "/var/lib/battery_ledger"
+#define LOAD_SHED_STATE_PATH                   "/var/lib/battery_load_shed"
 #define DATA_LOGGER_ENABLED                    1
 #define INFO_LOGGER_ENABLED                    1
 #define ALERT_ENABLED                          1
+#define LOAD_SHED_ENABLED                      1
 
 #define MIN_VOLTAGE                            3.300
 #define MAX_VOLTAGE                            4.000
@@ -15,7 +20,7 @@
 #define ALERT_PIN                              21
 
 #define LOW_BATTERY_ALERT                      0.005
-#define BATTERY_CAPACITY                       1 // Ah
+#define BATTERY_CAPACITY                       1 // Ah, nominal until the ledger learns the real one
 
 #define DATA_SIZE                              sizeof(float)
 #define RW_PERMISSION                          0600
@@ -37,7 +42,55 @@
 #define SOC_REFRESH_DELAY                      5
 #define SOC_ADJUSTMENT_STEP                    0.01
 #define SOC_CALIBRATION_THRESHOLD              0.4
-#define DELTA_TIME_CHARGING_ADJUSTMENT         0.6
-#define DELTA_TIME_DISCHARGING_ADJUSTMENT      0.7
+#define COULOMBIC_EFFICIENCY                   0.99
+
+// Sampling thread, measurements reach the I/O thread through the sample ring
+#define SAMPLER_RT_PRIORITY                    0 // SCHED_FIFO priority, 0 keeps SCHED_OTHER
+#define SAMPLER_CPU                            -1 // CPU to pin the sampler to, -1 leaves it unpinned
+#define SAMPLER_LOCK_MEMORY                    1
+#define SAMPLER_STACK_SIZE                     (256 * 1024)
+#define SAMPLE_RING_SIZE                       256 // power of two
+#define IO_POLL_INTERVAL_MS                    100
+
+// History tiers, finest first: bucket width in seconds and buckets kept
+#define HISTORY_TIER_COUNT                     3
+#define HISTORY_TIER_RESOLUTIONS               { 5, 60, 3600 }
+#define HISTORY_TIER_LENGTHS                   { 720, 10080, 8760 } // 1 hour, 1 week, 1 year
+
+// Shutdown planner, all durations in seconds
+#define SHUTDOWN_DRY_RUN                       0 // log instead of powering off
+#define SHUTDOWN_MAX_HOOKS                     8
+#define SHUTDOWN_DEFAULT_PIPELINE_TIME         5.0
+#define SHUTDOWN_TAIL_TIME                     20.0 // from the poweroff request until power is cut
+#define SHUTDOWN_SAFETY_MARGIN                 30.0
+#define SHUTDOWN_LEARNING_WEIGHT               0.3
+#define SHUTDOWN_CURRENT_SMOOTHING             0.2
+#define SHUTDOWN_HOOK_BUDGET_PERSIST           1.0
+#define SHUTDOWN_HOOK_BUDGET_HISTORY           2.0
+#define SHUTDOWN_HOOK_BUDGET_ALERT             1.5
+#define SHUTDOWN_HOOK_BUDGET_SYNC              10.0
+
+// Load shedding on battery, a stage engages at or below its SoC or at or above its power (W)
+#define LOAD_SHED_SYSFS_ROOT                   "/sys"
+#define LOAD_SHED_MAX_POLICIES                 8
+#define LOAD_SHED_GOVERNOR                     "conservative" // has to keep scaling, powersave would leave the frequency cap nothing to do
+#define LOAD_SHED_GOVERNOR_SOC                 0.8
+#define LOAD_SHED_GOVERNOR_POWER               6.0
+#define LOAD_SHED_MAX_FREQ                     "600000" // kHz
+#define LOAD_SHED_MAX_FREQ_SOC                 0.5
+#define LOAD_SHED_MAX_FREQ_POWER               7.0
+#define LOAD_SHED_UNITS                        "" // space separated systemd units with their suffix, empty skips the stage
+#define LOAD_SHED_UNITS_SOC                    0.3
+#define LOAD_SHED_UNITS_POWER                  8.0
+#define LOAD_SHED_MAX_UNITS                    8
+#define LOAD_SHED_UNIT_COMMAND                 "/bin/systemctl" // run without a shell as <command> --no-block stop|start <units>
+#define LOAD_SHED_SETTLE_TIME                  30 // s before a stage's effect is measured
+#define LOAD_SHED_POWER_SMOOTHING              0.2
+
+// Capacity learning from discharge cycles that end at the voltage cutoff
+#define LEDGER_MIN_CAPACITY_SPAN               0.5 // SoC the cycle has to cover
+#define LEDGER_MIN_CAPACITY_RATIO              0.2 // of BATTERY_CAPACITY
+#define LEDGER_MAX_CAPACITY_RATIO              2.0
+#define LEDGER_CAPACITY_WEIGHT                 0.2
 
 #endif
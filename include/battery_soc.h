@@ -6,22 +6,38 @@
 #include <stdint.h>  
 #include <string.h>  
 #include <errno.h>
-#include <sys/time.h> 
 #include <unistd.h>
 #include <math.h>
 
 #include "types/result.h"
 #include "types/battery_state.h"
 #include "electrical_data.h"
+#include "coulomb_counter.h"
+#include "cycle_ledger.h"
 #include "logger.h"
-#include "data_logger.h"
+#include "shutdown_planner.h"
+#include "sampler.h"
 #include "../globalConfig.h"
 
-BatteryState getState();
+#define SOC_NO_TARGET -1
+#define SOC_PENDING_CYCLES 4
+
+typedef struct {
+    BatteryState state;
+    CoulombCounter counter;
+    float slewTarget; // SoC approached at a limited rate, SOC_NO_TARGET when idle
+    float capacity;   // Ah, learned from the cycle ledger
+    CycleStats cycle;
+    char cycleOpen;
+    CycleRecord pending[SOC_PENDING_CYCLES]; // closed cycles the ring had no room for yet
+    int pendingCount;
+} SocMachine;
+
+BatteryState classifyState(const ElectricalSnapshot* snapshot, BatteryState state);
 float trimSoc(float soc);
-double calculateDeltaTime(struct timeval* previous_time);
-float updateStateOfCharge(float soc, float current, float time_hours);
-int calculateChargingSoC(float *soc_mem_ref);
-int calculateDischargingSoC(float *soc_mem_ref);
+float updateStateOfCharge(float soc, double charge, float capacity);
+float slewStateOfCharge(float soc, float target, double interval);
+void initSocMachine(SocMachine* machine, float capacity);
+int stepSocMachine(SocMachine* machine, float* soc_mem_ref);
 
 #endif
\ No newline at end of file
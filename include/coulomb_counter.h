@@ -0,0 +1,21 @@
+#ifndef COULOMBCOUNTER_H
+#define COULOMBCOUNTER_H
+
+#include <math.h>
+#include <time.h>
+
+#include "../globalConfig.h"
+
+typedef struct {
+    double chargeIn;        // C, before COULOMBIC_EFFICIENCY is applied
+    double chargeOut;       // C
+    double interval;        // s, between the last two samples
+    float lastCurrent;
+    struct timespec lastStamp;
+    char primed;
+} CoulombCounter;
+
+void resetCoulombCounter(CoulombCounter* counter);
+double integrateCurrent(CoulombCounter* counter, float current, const struct timespec* stamp);
+
+#endif
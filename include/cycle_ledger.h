@@ -0,0 +1,87 @@
+#ifndef CYCLELEDGER_H
+#define CYCLELEDGER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "types/result.h"
+#include "types/battery_state.h"
+#include "logger.h"
+#include "../globalConfig.h"
+
+typedef enum {
+    CYCLE_END_CHARGED,
+    CYCLE_END_UNPLUGGED,
+    CYCLE_END_CHARGER_RETURNED,
+    CYCLE_END_DEPLETED,
+    CYCLE_END_SHUTDOWN
+} CycleEndReason;
+
+// One record per charge or discharge cycle, appended to LEDGER_PATH
+typedef struct {
+    int64_t start;          // unix time
+    uint32_t duration;      // s
+    uint8_t kind;           // CHARGING or DISCHARGING
+    uint8_t endReason;
+    uint16_t reserved;
+    float ahIn;
+    float ahOut;
+    float whIn;
+    float whOut;
+    float minVoltage;
+    float maxVoltage;
+    float peakPower;
+    float socStart;
+    float socEnd;           // from the voltage when the cycle ends in a shutdown or depletion
+    float capacity;         // learned capacity after this cycle, Ah
+} CycleRecord;
+
+// Lifetime totals, kept up to date so an inventory only has to read this
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t recordSize;
+    uint32_t recordCount;
+    uint32_t chargeCycles;
+    float capacity;         // Ah
+    float fullCycles;       // discharged Ah over capacity
+    double ahIn;
+    double ahOut;
+    double whIn;
+    double whOut;
+} LedgerHeader;
+
+// Running totals of the open cycle, kept by the SoC state machine
+typedef struct {
+    BatteryState kind;
+    time_t start;
+    struct timespec startStamp;
+    double ahIn;
+    double ahOut;
+    double whIn;
+    double whOut;
+    float minVoltage;
+    float maxVoltage;
+    float peakPower;
+    float socStart;
+} CycleStats;
+
+void openCycle(CycleStats* stats, BatteryState kind, const struct timespec* stamp, float soc);
+void accumulateCycle(CycleStats* stats, double chargeIn, double chargeOut, float voltage, float power);
+void closeCycle(const CycleStats* stats, CycleEndReason reason, const struct timespec* stamp, float soc, CycleRecord* record);
+float learnCapacity(float capacity, const CycleRecord* record);
+
+Result initCycleLedger(const char* ledgerPath);
+float getLearnedCapacity();
+int appendCycleRecord(const CycleRecord* record);
+void disposeCycleLedger();
+
+#endif
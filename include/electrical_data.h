@@ -9,17 +9,26 @@
 #include <sys/ioctl.h>
 #include <linux/i2c-dev.h>
 #include <math.h>
-#include <sys/time.h> 
+#include <time.h>
 
 #include "../globalConfig.h"
 
+typedef struct {
+    float power;
+    float voltage;
+    float current;
+    struct timespec stamp; // completion of the current reading
+} ElectricalSnapshot;
+
 void configureElectricalData(int p_fd);
 int tryReadRegister(uint8_t reg, int16_t* result);
 float convertToValidUnit(int16_t rawValue, float lsb);
 int tryReadPower(float* power);
 int tryReadCurrent(float* current);
+int tryReadCurrentAt(float* current, struct timespec* stamp);
 int tryReadVoltage(float* voltage);
-int dischargeCalibration(float* calibration);
-int chargeCalibration(float* calibration);
+int tryReadSnapshot(ElectricalSnapshot* snapshot);
+float dischargeCalibration(float busVoltage);
+float chargeCalibration(float power);
 
 #endif
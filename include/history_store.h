@@ -0,0 +1,61 @@
+#ifndef HISTORYSTORE_H
+#define HISTORYSTORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "types/result.h"
+#include "../globalConfig.h"
+
+typedef struct {
+    float min;
+    float max;
+    float mean;
+} HistoryRollup;
+
+typedef struct {
+    int64_t bucket;   // start time / tier resolution, -1 while unused
+    int64_t previous; // bucket of the previous occupied point, -1 when there is none
+    uint32_t count;   // 0 marks a bucket the samples skipped over
+    HistoryRollup soc;
+    HistoryRollup voltage;
+    HistoryRollup current;
+    HistoryRollup power;
+} HistoryPoint;
+
+typedef struct {
+    uint32_t resolution;
+    uint32_t length;
+    int64_t newestBucket;
+} HistoryTier;
+
+// Layout of HISTORY_PATH: this header followed by the points of every tier,
+// finest tier first.
+//
+// Other processes read it through attachHistoryStore() and queryHistory(), or
+// by hand with the same protocol: load sequence, retry while it is odd, copy
+// the points, load sequence again and retry when it changed. The daemon makes
+// sequence odd for the duration of every update.
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t tierCount;
+    atomic_uint sequence;
+    HistoryTier tiers[HISTORY_TIER_COUNT];
+} HistoryHeader;
+
+Result initHistoryStore(const char* historyPath);
+Result attachHistoryStore(const char* historyPath);
+void recordHistory(time_t time, float soc, float voltage, float current, float power);
+size_t queryHistory(time_t from, time_t to, HistoryPoint* points, size_t maxPoints, uint32_t* resolution);
+int syncHistoryStore();
+void disposeHistoryStore();
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef LOADSHEDDER_H
+#define LOADSHEDDER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "types/result.h"
+#include "types/battery_state.h"
+#include "logger.h"
+#include "shutdown_planner.h"
+#include "../globalConfig.h"
+
+typedef enum {
+    SHED_GOVERNOR,
+    SHED_MAX_FREQ,
+    SHED_UNITS
+} ShedAction;
+
+typedef struct {
+    const char* name;
+    ShedAction action;
+    float socThreshold;
+    float powerThreshold;
+    char measured;
+    time_t appliedAt;
+    float powerBefore;
+} ShedStage;
+
+typedef struct {
+    char path[PATH_MAX];
+    char governor[32];
+    char maxFreq[32];
+} CpufreqPolicy;
+
+// Persisted in LOAD_SHED_STATE_PATH so the values a stage overwrote can still
+// be put back after the daemon was killed or restarted with stages applied.
+typedef struct {
+    uint32_t magic;
+    uint32_t appliedStages;
+    uint32_t policyCount;
+    CpufreqPolicy policies[LOAD_SHED_MAX_POLICIES];
+} LoadShedState;
+
+Result initLoadShedder(const char* sysfsRoot, const char* statePath);
+void evaluateLoadShedding(BatteryState state, float soc, float power, time_t time);
+void restoreLoadShedding();
+void releaseLoadShedding();
+void disposeLoadShedder();
+
+#endif
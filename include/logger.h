@@ -6,13 +6,17 @@
 #include <stdarg.h>
 #include <time.h>
 
-static FILE* file = NULL;
-
 #define LOG_INFO_CODE    1
 #define LOG_ERROR_CODE   2
+#define LOG_MESSAGE_SIZE 192
+
+// Takes over formatted messages of the calling thread instead of writing them
+typedef void (*LogDeferral)(int logLevel, time_t raw_time, const char* message);
 
 int initLog(const char* filename);
 void logMessage(int logLevel, const char* format, ...);
+void setLogDeferral(LogDeferral handler);
+void writeLogMessage(int logLevel, time_t raw_time, const char* message);
 void disposeLogger();
 
 #define LOG_ERROR(...) logMessage(LOG_ERROR_CODE, __VA_ARGS__)
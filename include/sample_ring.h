@@ -0,0 +1,58 @@
+#ifndef SAMPLERING_H
+#define SAMPLERING_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "logger.h"
+#include "types/battery_state.h"
+#include "cycle_ledger.h"
+#include "../globalConfig.h"
+
+typedef enum {
+    SAMPLE_EVENT,
+    LOG_EVENT,
+    SHUTDOWN_EVENT,
+    CYCLE_EVENT
+} SampleEventType;
+
+typedef struct {
+    SampleEventType type;
+    time_t time;
+    union {
+        struct {
+            BatteryState state;
+            float current;
+            float power;
+            float voltage;
+            float soc;
+            double interval;
+        } sample;
+        struct {
+            int level;
+            char text[LOG_MESSAGE_SIZE];
+        } log;
+        struct {
+            double availableTime;
+            const char* reason;
+        } shutdown;
+        CycleRecord cycle;
+    };
+} SampleEvent;
+
+// Single producer, single consumer. head is only written by the producer and
+// tail only by the consumer, so neither side ever waits on the other.
+typedef struct {
+    SampleEvent slots[SAMPLE_RING_SIZE];
+    _Alignas(64) atomic_size_t head;
+    _Alignas(64) atomic_size_t tail;
+    atomic_ulong overruns;
+} SampleRing;
+
+void initSampleRing(SampleRing* ring);
+int pushSampleEvent(SampleRing* ring, const SampleEvent* event);
+int popSampleEvent(SampleRing* ring, SampleEvent* event);
+unsigned long takeSampleOverruns(SampleRing* ring);
+
+#endif
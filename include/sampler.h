@@ -0,0 +1,30 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "types/result.h"
+#include "sample_ring.h"
+#include "history_store.h"
+#include "data_logger.h"
+#if LOAD_SHED_ENABLED
+    #include "load_shedder.h"
+#endif
+#include "../globalConfig.h"
+
+Result startSampler(float* soc_mem_ref);
+void stopSampler();
+void publishSample(BatteryState state, float current, float power, float voltage, double interval, float soc);
+void requestShutdown(const char* reason, double availableTime);
+int publishCycle(const CycleRecord* record);
+void drainSampleEvents();
+
+#endif
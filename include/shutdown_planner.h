@@ -0,0 +1,51 @@
+#ifndef SHUTDOWNPLANNER_H
+#define SHUTDOWNPLANNER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/reboot.h>
+
+#include "types/result.h"
+#include "logger.h"
+#include "../globalConfig.h"
+
+// A hook receives the CLOCK_MONOTONIC deadline (seconds) it has to finish by.
+typedef int (*ShutdownHookFn)(void* ctx, double deadline);
+typedef int (*PoweroffHandler)(void);
+
+typedef struct {
+    const char* name;
+    ShutdownHookFn fn;
+    void* ctx;
+    double budget;
+    char essential; // runs even when there is no time left for it
+} ShutdownHook;
+
+// Persisted in SHUTDOWN_STATE_PATH so the learned pipeline time survives reboots.
+typedef struct {
+    uint32_t magic;
+    uint32_t samples;
+    double pipelineTime;
+} ShutdownPlannerState;
+
+Result initShutdownPlanner(const char* statePath);
+int registerShutdownHook(const char* name, ShutdownHookFn fn, void* ctx, double budget, char essential);
+void setPoweroffHandler(PoweroffHandler handler);
+void observeDischarge(float current);
+double predictRuntime(float soc, float capacity);
+double requiredShutdownTime();
+int shouldStartShutdown(float soc, float capacity);
+int isShutdownInProgress();
+int executeShutdown(const char* reason, double availableTime);
+void disposeShutdownPlanner();
+
+#endif
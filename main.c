@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <fcntl.h> 
 #include <unistd.h>      
+#include <signal.h>
 #include <sys/mman.h>
 
 #include "include/battery_soc.h"
@@ -15,6 +16,13 @@
 #endif
 #include "include/logger.h"
 #include "include/data_logger.h"
+#include "include/shutdown_planner.h"
+#include "include/sampler.h"
+#include "include/history_store.h"
+#include "include/cycle_ledger.h"
+#if LOAD_SHED_ENABLED
+    #include "include/load_shedder.h"
+#endif
 
 typedef struct {
     float* soc_mem_ref;
@@ -23,9 +31,19 @@ typedef struct {
     int status;
 } SetupResult;
 
+static volatile sig_atomic_t running = 1;
+
 SetupResult setup();
 void cleanup(int i2cFd, int fd_file, float *soc_mem_ref);
 Result configureINA219(int i2cFd);
+int persistSocHook(void* ctx, double deadline);
+int historyHook(void* ctx, double deadline);
+int alertHook(void* ctx, double deadline);
+int syncHook(void* ctx, double deadline);
+void stopRunning(int signum);
+#if SHUTDOWN_DRY_RUN
+    int dryRunPoweroff();
+#endif
 
 void cleanup(int i2cFd, int fd_file, float *soc_mem_ref) {
     if (i2cFd != -1) {
@@ -38,6 +56,13 @@ void cleanup(int i2cFd, int fd_file, float *soc_mem_ref) {
         munmap(soc_mem_ref, DATA_SIZE);
     }
     shm_unlink(SHM_BACKUP);
+    disposeShutdownPlanner();
+    disposeHistoryStore();
+    disposeCycleLedger();
+    #if LOAD_SHED_ENABLED
+        releaseLoadShedding();
+        disposeLoadShedder();
+    #endif
     #if ALERT_ENABLED
         disposeAlertService();
     #endif
@@ -61,6 +86,43 @@ Result configureINA219(int i2cFd) {
     return res;
 }
 
+int persistSocHook(void* ctx, double deadline) {
+    (void)deadline;
+    if (msync(ctx, DATA_SIZE, MS_SYNC) == -1) {
+        return errno;
+    }
+    return 0;
+}
+
+int historyHook(void* ctx, double deadline) {
+    (void)ctx;
+    (void)deadline;
+    return syncHistoryStore();
+}
+
+int alertHook(void* ctx, double deadline) {
+    (void)ctx;
+    (void)deadline;
+    #if ALERT_ENABLED
+        alert();
+    #endif
+    return 0;
+}
+
+int syncHook(void* ctx, double deadline) {
+    (void)ctx;
+    (void)deadline;
+    sync();
+    return 0;
+}
+
+#if SHUTDOWN_DRY_RUN
+    int dryRunPoweroff() {
+        LOG_INFO("Dry run, skipping poweroff");
+        return 0;
+    }
+#endif
+
 SetupResult setup() {
     SetupResult res;
     res.status = -1;
@@ -73,23 +135,23 @@ SetupResult setup() {
 
     Result resI2C = configureI2C(&res.i2cFd);
     if (resI2C.status == -1) {
-        cleanup(res.i2cFd, res.fileFd, NULL);
         LOG_ERROR(resI2C.message);
+        cleanup(res.i2cFd, res.fileFd, NULL);
         return res;
     }
 
     Result resIn1219 = configureINA219(res.i2cFd);
     if (resIn1219.status == -1) {
+        LOG_ERROR(resIn1219.message);
         cleanup(res.i2cFd, res.fileFd, NULL);
-        LOG_ERROR(resI2C.message);
         return res;
     }
 
     #if ALERT_ENABLED
         Result resAlertService = setupAlertService(ALERT_PIN);
         if (resAlertService.status == -1) {
-            cleanup(res.i2cFd, res.fileFd, NULL);
             LOG_ERROR(resAlertService.message);
+            cleanup(res.i2cFd, res.fileFd, NULL);
             return res;
         }
     #endif
@@ -97,8 +159,8 @@ SetupResult setup() {
     #if DATA_LOGGER_ENABLED
         Result resCreateLog = createLogFile(DATA_LOGGER_PATH);
         if (resCreateLog.status == -1) {
-            cleanup(res.i2cFd, res.fileFd, NULL);
             LOG_ERROR(resCreateLog.message);
+            cleanup(res.i2cFd, res.fileFd, NULL);
             return res;
         }
     #endif
@@ -121,53 +183,81 @@ SetupResult setup() {
         return res;
     }
 
+    Result resHistory = initHistoryStore(HISTORY_PATH);
+    if (resHistory.status == -1) {
+        LOG_ERROR("%s, running without history", resHistory.message);
+    }
+
+    // The ledger only keeps statistics, without it the capacity starts from BATTERY_CAPACITY
+    Result resLedger = initCycleLedger(LEDGER_PATH);
+    if (resLedger.status == -1) {
+        LOG_ERROR("%s, running without the cycle ledger", resLedger.message);
+    }
+
+    #if LOAD_SHED_ENABLED
+        Result resLoadShed = initLoadShedder(LOAD_SHED_SYSFS_ROOT, LOAD_SHED_STATE_PATH);
+        if (resLoadShed.status == -1) {
+            LOG_ERROR("%s, running without load shedding", resLoadShed.message);
+        }
+    #endif
+
+    #if SHUTDOWN_DRY_RUN
+        setPoweroffHandler(dryRunPoweroff);
+    #endif
+    Result resShutdown = initShutdownPlanner(SHUTDOWN_STATE_PATH);
+    if (resShutdown.status == -1) {
+        LOG_ERROR(resShutdown.message);
+        cleanup(res.i2cFd, res.fileFd, res.soc_mem_ref);
+        return res;
+    }
+    registerShutdownHook("persist-soc", persistSocHook, res.soc_mem_ref, SHUTDOWN_HOOK_BUDGET_PERSIST, 0);
+    registerShutdownHook("persist-history", historyHook, NULL, SHUTDOWN_HOOK_BUDGET_HISTORY, 0);
+    #if ALERT_ENABLED
+        registerShutdownHook("alert", alertHook, NULL, SHUTDOWN_HOOK_BUDGET_ALERT, 1);
+    #endif
+    registerShutdownHook("sync", syncHook, NULL, SHUTDOWN_HOOK_BUDGET_SYNC, 1);
+
     #if INFO_LOGGER_ENABLED
         LOG_INFO("Initial SoC: %.3f", *res.soc_mem_ref);
+        LOG_INFO("Battery capacity: %.3fAh", getLearnedCapacity());
     #endif
 
     res.status = 0;
     return res;
 }
 
+void stopRunning(int signum) {
+    (void)signum;
+    running = 0;
+}
+
 int main() {
     SetupResult res = setup();
     if (res.status == -1)
         return -1;
 
-    while(1) {
-        BatteryState state = getState();
-        switch (state) {
-            case CHARGING:
-                #if INFO_LOGGER_ENABLED
-                    LOG_INFO("CHARGING\n");
-                #endif
-                calculateChargingSoC(res.soc_mem_ref);
-                break;
-            case DISCHARGING:
-                #if INFO_LOGGER_ENABLED
-                    LOG_INFO("DISCHARGING\n");
-                #endif
-                calculateDischargingSoC(res.soc_mem_ref);
-                system("sudo shutdown -h now");
-                break;
-            case ACPOWER:
-                #if INFO_LOGGER_ENABLED
-                    LOG_INFO("ACPOWER\n");
-                #endif
-                break;
-            default: //DEPLETED
-                #if INFO_LOGGER_ENABLED
-                    LOG_INFO("DEPLETED\n");
-                #endif
-                #if ALERT_ENABLED 
-                    alert();
-                #endif          
-                system("sudo shutdown -h now");
-                break;
-        }
-        sleep(1);
+    // systemd stops the service with SIGTERM, the loop has to end for cleanup
+    // to put back anything the load shedder changed while on external power.
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopRunning;
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    Result resSampler = startSampler(res.soc_mem_ref);
+    if (resSampler.status == -1) {
+        LOG_ERROR(resSampler.message);
+        cleanup(res.i2cFd, res.fileFd, res.soc_mem_ref);
+        return -1;
+    }
+
+    while(running) {
+        drainSampleEvents();
+        usleep(IO_POLL_INTERVAL_MS * 1000);
     }
 
+    stopSampler();
+    drainSampleEvents();
     cleanup(res.i2cFd, res.fileFd, res.soc_mem_ref);
 
     return 0;
@@ -36,11 +36,34 @@ sudo bash -c "echo 'Restart=always' >> $SERVICE_FILE"
 sudo bash -c "echo 'RestartSec=1' >> $SERVICE_FILE"
 sudo bash -c "echo 'User=$USER' >> $SERVICE_FILE"
 sudo bash -c "echo 'ExecStart=$APP_PATH_EXECUTABLE' >> $SERVICE_FILE"
+sudo bash -c "echo 'AmbientCapabilities=CAP_KILL CAP_SYS_BOOT CAP_SYS_NICE CAP_IPC_LOCK' >> $SERVICE_FILE"
 
 sudo bash -c "echo '' >> $SERVICE_FILE"
 sudo bash -c "echo '[Install]' >> $SERVICE_FILE"
 sudo bash -c "echo 'WantedBy=multi-user.target' >> $SERVICE_FILE"
 
+echo "Granting load shedding permissions..."
+
+TMPFILES_FILE="/etc/tmpfiles.d/ups-driver.conf"
+
+sudo bash -c "echo 'z /sys/devices/system/cpu/cpufreq/policy*/scaling_governor 0664 root $GROUP -' > $TMPFILES_FILE"
+sudo bash -c "echo 'z /sys/devices/system/cpu/cpufreq/policy*/scaling_max_freq 0664 root $GROUP -' >> $TMPFILES_FILE"
+sudo systemd-tmpfiles --create "$TMPFILES_FILE"
+
+POLKIT_FILE="/etc/polkit-1/rules.d/50-ups-driver.rules"
+SHED_UNITS=$(sed -n 's/^#define LOAD_SHED_UNITS  *"\([^"]*\)".*/\1/p' "$APP_PATH/globalConfig.h")
+
+if [ -n "$SHED_UNITS" ]; then
+    SHED_UNIT_LIST=$(printf '"%s",' $SHED_UNITS)
+    sudo bash -c "echo 'polkit.addRule(function(action, subject) {' > $POLKIT_FILE"
+    sudo bash -c "echo '    if (action.id == \"org.freedesktop.systemd1.manage-units\" && subject.user == \"$USER\" &&' >> $POLKIT_FILE"
+    sudo bash -c "echo '        [${SHED_UNIT_LIST%,}].indexOf(action.lookup(\"unit\")) >= 0 &&' >> $POLKIT_FILE"
+    sudo bash -c "echo '        (action.lookup(\"verb\") == \"start\" || action.lookup(\"verb\") == \"stop\")) {' >> $POLKIT_FILE"
+    sudo bash -c "echo '        return polkit.Result.YES;' >> $POLKIT_FILE"
+    sudo bash -c "echo '    }' >> $POLKIT_FILE"
+    sudo bash -c "echo '});' >> $POLKIT_FILE"
+fi
+
 sudo systemctl daemon-reload
 sudo systemctl enable ups-driver.service
 sudo systemctl start ups-driver.service
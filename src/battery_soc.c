@@ -1,36 +1,27 @@
 #include "../include/battery_soc.h"
 
-BatteryState getState() {
-    float power;
-    float powerRes = tryReadPower(&power);
-    if (powerRes < 0) {
-        LOG_ERROR("Failed to get valid power measurement %s", strerror(powerRes));
-        return -1;
+#if INFO_LOGGER_ENABLED
+    static const char* stateNames[] = { "CHARGING", "DISCHARGING", "ACPOWER", "DEPLETED" };
+#endif
+
+// A charge only completes once power and current have both settled, so the
+// tapering end of a charge does not flap between CHARGING and ACPOWER.
+BatteryState classifyState(const ElectricalSnapshot* snapshot, BatteryState state) {
+    if (state == CHARGING && snapshot->current >= 0) {
+        if (snapshot->power <= 0.05 && snapshot->current <= 0.01) { // Charging done
+            return ACPOWER;
+        }
+        return CHARGING;
     }
-    if (power < 0.1) {
+    if (snapshot->power < 0.1) {
         return ACPOWER;
     }
-
-    float voltage;
-    float voltageRes = tryReadVoltage(&voltage);
-    if (voltageRes < 0) {
-        LOG_ERROR("Failed to get valid voltage measurement %s", strerror(voltageRes));
-        return -1; 
-    }
-    if (voltage < MIN_VOLTAGE) {
+    if (snapshot->voltage < MIN_VOLTAGE) {
         return DEPLETED;
     }
-
-    float current;
-    float currentRes = tryReadCurrent(&current);
-    if (currentRes < 0) {
-        LOG_ERROR("Failed to get valid current measurement %s", strerror(currentRes));
-        return -1; 
-    }
-    if (current > 0) {
+    if (snapshot->current > 0) {
         return CHARGING;
     }
-
     return DISCHARGING;
 }
 
@@ -42,162 +33,166 @@ float trimSoc(float soc) {
     return soc;
 }
 
-double calculateDeltaTime(struct timeval* previous_time) {
-    struct timeval current_time;
-
-    gettimeofday(&current_time, NULL);
-
-    double delta_time = (double)(current_time.tv_sec - previous_time->tv_sec) +
-                (double)(current_time.tv_usec - previous_time->tv_usec) / 1000000.0;
-    
-    *previous_time = current_time; 
-
-    if (delta_time > 7) {
-        #if INFO_LOGGER_ENABLED
-            LOG_INFO("delta time dillation: %.6f seconds", delta_time);
-        #endif
-        delta_time = 5.005;
-    }
-
-    return delta_time;
-}
-
-float updateStateOfCharge(float soc, float current, float time_hours) {
-    float soc_new = soc + (current / BATTERY_CAPACITY) * time_hours;
+float updateStateOfCharge(float soc, double charge, float capacity) {
+    float soc_new = soc + charge / capacity;
     return trimSoc(soc_new);
 }
 
-int calculateChargingSoC(float *soc_mem_ref) {
-    struct timeval previous_time;
-    gettimeofday(&previous_time, NULL);
-
-    float calibration = 0;
-    int calibResult = chargeCalibration(&calibration);
-    if (calibResult < 0) {
-        LOG_ERROR("Failed to get valid charge calibration %s", strerror(calibResult));
-        return -1;        
-    }
+// Moves SoC towards target by at most SOC_ADJUSTMENT_STEP per SOC_REFRESH_DELAY
+float slewStateOfCharge(float soc, float target, double interval) {
+    float step = SOC_ADJUSTMENT_STEP * interval / SOC_REFRESH_DELAY;
+    if (soc < target)
+        return soc + step < target ? soc + step : target;
+    return soc - step > target ? soc - step : target;
+}
 
+static void calibrate(float* soc_mem_ref, float calibration) {
     #if INFO_LOGGER_ENABLED
         LOG_INFO("Calibration SoC: %.3f", calibration);
     #endif
     if (fabs((*soc_mem_ref) - calibration) > SOC_CALIBRATION_THRESHOLD) {
         *soc_mem_ref = calibration;
     }
+}
 
-    while (1) {
-        float power;
-        float powerRes = tryReadPower(&power);
-        if (powerRes < 0) {
-            LOG_ERROR("Failed to get valid power measurement %s", strerror(powerRes));
-        }
+// Publishes the closed cycles oldest first, each one stays queued until the
+// ring took it.
+static void flushCycles(SocMachine* machine) {
+    int published = 0;
+    while (published < machine->pendingCount && publishCycle(&machine->pending[published]) == 0) {
+        published++;
+    }
+    memmove(machine->pending, machine->pending + published, (machine->pendingCount - published) * sizeof(CycleRecord));
+    machine->pendingCount -= published;
+}
 
-        float current;
-        float currentRes = tryReadCurrent(&current);
-        if (currentRes < 0) {
-            LOG_ERROR("Failed to get valid current measurement %s", strerror(currentRes));
-            return -1; 
-        }
+static void endCycle(SocMachine* machine, CycleEndReason reason, const ElectricalSnapshot* snapshot, float soc) {
+    if (!machine->cycleOpen) {
+        return;
+    }
+    machine->cycleOpen = 0;
 
-        if (power <= 0.05 && current >= 0 && current <= 0.01) { // Charging done
-            break;
-        }
+    if (machine->pendingCount == SOC_PENDING_CYCLES) {
+        LOG_ERROR("Cycle records are not getting through, dropping the oldest");
+        memmove(machine->pending, machine->pending + 1, (SOC_PENDING_CYCLES - 1) * sizeof(CycleRecord));
+        machine->pendingCount--;
+    }
 
-        if (current < 0) { // Charger was unplugged
-            return 0;
-        }
+    CycleRecord* record = &machine->pending[machine->pendingCount++];
+    closeCycle(&machine->cycle, reason, &snapshot->stamp, soc, record);
+    machine->capacity = learnCapacity(machine->capacity, record);
+    record->capacity = machine->capacity;
+    flushCycles(machine);
+}
 
-        double delta_time = calculateDeltaTime(&previous_time);
-        double time_hours = (delta_time - DELTA_TIME_CHARGING_ADJUSTMENT) / 3600.00;
+static CycleEndReason endReason(BatteryState previous, BatteryState next) {
+    if (next == DEPLETED)
+        return CYCLE_END_DEPLETED;
+    if (previous == CHARGING)
+        return next == ACPOWER ? CYCLE_END_CHARGED : CYCLE_END_UNPLUGGED;
+    return CYCLE_END_CHARGER_RETURNED;
+}
 
-        *soc_mem_ref = updateStateOfCharge(*soc_mem_ref, current, time_hours);
+static void enterState(SocMachine* machine, BatteryState next, const ElectricalSnapshot* snapshot, float* soc_mem_ref) {
+    BatteryState previous = machine->state;
 
-        #if DATA_LOGGER_ENABLED
-            float voltage;
-            float voltageRes = tryReadVoltage(&voltage);
-            if (voltageRes < 0) {
-                LOG_ERROR("Failed to get valid voltage measurement %s", strerror(voltageRes));
-            }
+    #if INFO_LOGGER_ENABLED
+        LOG_INFO("%s", stateNames[next]);
+    #endif
 
-            logMessages(current, power, voltage, delta_time, *soc_mem_ref);
-        #endif
+    endCycle(machine, endReason(previous, next), snapshot, next == DEPLETED ? 0 : *soc_mem_ref);
 
-        sleep(SOC_REFRESH_DELAY);
+    machine->state = next;
+    machine->slewTarget = SOC_NO_TARGET;
+
+    switch (next) {
+        case CHARGING:
+            calibrate(soc_mem_ref, chargeCalibration(snapshot->power));
+            break;
+        case DISCHARGING:
+            calibrate(soc_mem_ref, dischargeCalibration(snapshot->voltage));
+            break;
+        case ACPOWER:
+            if (previous == CHARGING) { // Charging done
+                machine->slewTarget = 1;
+            }
+            break;
+        default: //DEPLETED
+            *soc_mem_ref = 0;
+            break;
     }
-    while (*soc_mem_ref < 1) {
-        *(soc_mem_ref) = trimSoc((*soc_mem_ref) + SOC_ADJUSTMENT_STEP);
-        #if INFO_LOGGER_ENABLED
-            LOG_INFO("Gracefully increasing SoC : %.3f", *soc_mem_ref);
-        #endif
 
-        sleep(SOC_REFRESH_DELAY);
+    if (next == CHARGING || next == DISCHARGING) {
+        openCycle(&machine->cycle, next, &snapshot->stamp, *soc_mem_ref);
+        machine->cycleOpen = 1;
     }
-    return 0;
 }
 
-int calculateDischargingSoC(float *soc_mem_ref) {
-    struct timeval previous_time;
-    gettimeofday(&previous_time, NULL);
+void initSocMachine(SocMachine* machine, float capacity) {
+    machine->state = -1;
+    machine->slewTarget = SOC_NO_TARGET;
+    machine->capacity = capacity;
+    machine->cycleOpen = 0;
+    machine->pendingCount = 0;
+    resetCoulombCounter(&machine->counter);
+}
 
-    float calibration = 0;
-    int calibResult = dischargeCalibration(&calibration);
-    if (calibResult < 0) {
-        LOG_ERROR("Failed to get valid discharge calibration %s", strerror(calibResult));
-        return -1;        
+// One snapshot and a constant amount of work per call, so a transition is
+// noticed within one sample period whatever state the battery is in.
+int stepSocMachine(SocMachine* machine, float* soc_mem_ref) {
+    ElectricalSnapshot snapshot;
+    int readRes = tryReadSnapshot(&snapshot);
+    if (readRes != 0) {
+        LOG_ERROR("Failed to get valid measurements %s", strerror(readRes));
+        return -1;
     }
 
-    #if INFO_LOGGER_ENABLED
-        LOG_INFO("Calibration SoC: %.3f", calibration);
-    #endif
-    if (fabs((*soc_mem_ref) - calibration) > SOC_CALIBRATION_THRESHOLD) {
-        *soc_mem_ref = calibration;
+    BatteryState next = classifyState(&snapshot, machine->state);
+    if (next != machine->state) {
+        enterState(machine, next, &snapshot, soc_mem_ref);
     }
 
-    while (1) {
-        float current;
-        float currentRes = tryReadCurrent(&current);
-        if (currentRes < 0) {
-            LOG_ERROR("Failed to get valid current measurement %s", strerror(currentRes));
-            return -1; 
-        }
-
-        if (current > 0) { // Charger was plugged
-            return 0;
-        }
+    double chargeIn = machine->counter.chargeIn;
+    double chargeOut = machine->counter.chargeOut;
+    double charge = integrateCurrent(&machine->counter, snapshot.current, &snapshot.stamp);
 
-        float voltage;
-        float voltageRes = tryReadVoltage(&voltage);
-        if (voltageRes < 0) {
-            LOG_ERROR("Failed to get valid voltage measurement %s", strerror(voltageRes));
-            return -1; 
-        }
+    if (machine->cycleOpen) {
+        accumulateCycle(&machine->cycle, machine->counter.chargeIn - chargeIn, machine->counter.chargeOut - chargeOut,
+                        snapshot.voltage, snapshot.power);
+    }
 
-        if (voltage < MIN_VOLTAGE) {
+    switch (machine->state) {
+        case CHARGING:
+            *soc_mem_ref = updateStateOfCharge(*soc_mem_ref, charge, machine->capacity);
             break;
-        }
-
-        double delta_time = calculateDeltaTime(&previous_time);
-        double time_hours = (delta_time - DELTA_TIME_DISCHARGING_ADJUSTMENT) / 3600.00;
-
-        *soc_mem_ref = updateStateOfCharge(*soc_mem_ref, current, time_hours);
-
-        #if DATA_LOGGER_ENABLED
-            float power;
-            float powerRes = tryReadPower(&power);
-            if (powerRes < 0) {
-                LOG_ERROR("Failed to get valid power measurement %s", strerror(powerRes));
+        case DISCHARGING:
+            *soc_mem_ref = updateStateOfCharge(*soc_mem_ref, charge, machine->capacity);
+            observeDischarge(snapshot.current);
+            if (shouldStartShutdown(*soc_mem_ref, machine->capacity)) { // Just enough runtime left for a clean shutdown
+                endCycle(machine, CYCLE_END_SHUTDOWN, &snapshot, trimSoc(dischargeCalibration(snapshot.voltage)));
+                requestShutdown("battery runtime exhausted", predictRuntime(*soc_mem_ref, machine->capacity));
             }
-            logMessages(current, power, voltage, delta_time, *soc_mem_ref);
-        #endif
-
-        sleep(SOC_REFRESH_DELAY);
+            break;
+        case DEPLETED:
+            if (!isShutdownInProgress()) { // Repeated until it gets through the ring
+                requestShutdown("battery depleted", 0);
+            }
+            break;
+        default:
+            break;
     }
-    while (*soc_mem_ref > 0) {
-        *(soc_mem_ref) = trimSoc((*soc_mem_ref) - SOC_ADJUSTMENT_STEP);
+
+    if (machine->slewTarget != SOC_NO_TARGET && *soc_mem_ref != machine->slewTarget) {
+        *soc_mem_ref = slewStateOfCharge(*soc_mem_ref, machine->slewTarget, machine->counter.interval);
         #if INFO_LOGGER_ENABLED
-            LOG_INFO("Gracefully decreasing SoC: %.3f", *soc_mem_ref);
+            LOG_INFO("Gracefully adjusting SoC: %.3f", *soc_mem_ref);
         #endif
-        sleep(SOC_REFRESH_DELAY);
     }
+
+    if (machine->pendingCount > 0) {
+        flushCycles(machine);
+    }
+
+    publishSample(machine->state, snapshot.current, snapshot.power, snapshot.voltage, machine->counter.interval, *soc_mem_ref);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,57 @@
+#include "../include/coulomb_counter.h"
+
+void resetCoulombCounter(CoulombCounter* counter) {
+    counter->chargeIn = 0;
+    counter->chargeOut = 0;
+    counter->interval = 0;
+    counter->lastCurrent = 0;
+    counter->primed = 0;
+}
+
+// Trapezoidal integration between the previous and the current sample.
+// Returns the net charge that reached the battery in Ah, with charging
+// scaled by COULOMBIC_EFFICIENCY.
+double integrateCurrent(CoulombCounter* counter, float current, const struct timespec* stamp) {
+    if (!counter->primed) {
+        counter->lastCurrent = current;
+        counter->lastStamp = *stamp;
+        counter->interval = 0;
+        counter->primed = 1;
+        return 0;
+    }
+
+    double dt = (double)(stamp->tv_sec - counter->lastStamp.tv_sec) +
+                (double)(stamp->tv_nsec - counter->lastStamp.tv_nsec) / 1000000000.0;
+    double i0 = counter->lastCurrent;
+    double i1 = current;
+
+    counter->lastCurrent = current;
+    counter->lastStamp = *stamp;
+    counter->interval = dt;
+
+    if (dt <= 0) {
+        return 0;
+    }
+
+    double in = 0;
+    double out = 0;
+    if (i0 * i1 >= 0) {
+        double area = (i0 + i1) / 2 * dt;
+        if (area >= 0)
+            in = area;
+        else
+            out = -area;
+    } else {
+        // Split the segment where the current crosses zero
+        double crossing = dt * fabs(i0) / (fabs(i0) + fabs(i1));
+        double first = i0 / 2 * crossing;
+        double second = i1 / 2 * (dt - crossing);
+        in = first > 0 ? first : second;
+        out = first > 0 ? -second : -first;
+    }
+
+    counter->chargeIn += in;
+    counter->chargeOut += out;
+
+    return (in * COULOMBIC_EFFICIENCY - out) / 3600.0;
+}
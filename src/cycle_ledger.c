@@ -0,0 +1,214 @@
+#include "../include/cycle_ledger.h"
+
+#define LEDGER_MAGIC 0x4c454447
+#define LEDGER_VERSION 1
+
+static int ledgerFd = -1;
+static LedgerHeader header;
+
+void openCycle(CycleStats* stats, BatteryState kind, const struct timespec* stamp, float soc) {
+    stats->kind = kind;
+    time(&stats->start);
+    stats->startStamp = *stamp;
+    stats->ahIn = 0;
+    stats->ahOut = 0;
+    stats->whIn = 0;
+    stats->whOut = 0;
+    stats->minVoltage = INFINITY;
+    stats->maxVoltage = 0;
+    stats->peakPower = 0;
+    stats->socStart = soc;
+}
+
+// chargeIn and chargeOut are the coulombs of the last sample interval
+void accumulateCycle(CycleStats* stats, double chargeIn, double chargeOut, float voltage, float power) {
+    stats->ahIn += chargeIn / 3600.0;
+    stats->ahOut += chargeOut / 3600.0;
+    stats->whIn += chargeIn * voltage / 3600.0;
+    stats->whOut += chargeOut * voltage / 3600.0;
+
+    if (voltage < stats->minVoltage)
+        stats->minVoltage = voltage;
+    if (voltage > stats->maxVoltage)
+        stats->maxVoltage = voltage;
+    if (power > stats->peakPower)
+        stats->peakPower = power;
+}
+
+void closeCycle(const CycleStats* stats, CycleEndReason reason, const struct timespec* stamp, float soc, CycleRecord* record) {
+    memset(record, 0, sizeof(CycleRecord));
+    record->start = stats->start;
+    record->duration = (uint32_t)(stamp->tv_sec - stats->startStamp.tv_sec);
+    record->kind = stats->kind;
+    record->endReason = reason;
+    record->ahIn = stats->ahIn;
+    record->ahOut = stats->ahOut;
+    record->whIn = stats->whIn;
+    record->whOut = stats->whOut;
+    record->minVoltage = stats->minVoltage;
+    record->maxVoltage = stats->maxVoltage;
+    record->peakPower = stats->peakPower;
+    record->socStart = stats->socStart;
+    record->socEnd = soc;
+}
+
+// Only discharges that end with SoC taken from the voltage give an end point
+// independent of the capacity, so only those, and only long ones, refine it.
+float learnCapacity(float capacity, const CycleRecord* record) {
+    if (record->kind != DISCHARGING ||
+        (record->endReason != CYCLE_END_DEPLETED && record->endReason != CYCLE_END_SHUTDOWN)) {
+        return capacity;
+    }
+
+    float span = record->socStart - record->socEnd;
+    if (span < LEDGER_MIN_CAPACITY_SPAN) {
+        return capacity;
+    }
+
+    float observed = (record->ahOut - record->ahIn * COULOMBIC_EFFICIENCY) / span;
+    if (observed < BATTERY_CAPACITY * LEDGER_MIN_CAPACITY_RATIO || observed > BATTERY_CAPACITY * LEDGER_MAX_CAPACITY_RATIO) {
+        return capacity;
+    }
+
+    return capacity + LEDGER_CAPACITY_WEIGHT * (observed - capacity);
+}
+
+static int writeHeader() {
+    if (pwrite(ledgerFd, &header, sizeof(header), 0) != sizeof(header)) {
+        return errno;
+    }
+    return 0;
+}
+
+static int layoutMatches() {
+    return header.magic == LEDGER_MAGIC && header.version == LEDGER_VERSION && header.recordSize == sizeof(CycleRecord);
+}
+
+// A power cut can leave the header counting a record whose data never reached
+// the disk. The missing records are dropped, the lifetime totals are kept.
+static int recoverRecordCount(off_t size) {
+    uint32_t stored = (uint32_t)((size - (off_t)sizeof(LedgerHeader)) / (off_t)sizeof(CycleRecord));
+    if (stored >= header.recordCount) {
+        return 0;
+    }
+
+    LOG_ERROR("Cycle ledger counts %u records but holds %u, dropping the missing ones", header.recordCount, stored);
+    header.recordCount = stored;
+    return writeHeader();
+}
+
+static void resetHeader() {
+    memset(&header, 0, sizeof(header));
+    header.magic = LEDGER_MAGIC;
+    header.version = LEDGER_VERSION;
+    header.recordSize = sizeof(CycleRecord);
+    header.capacity = BATTERY_CAPACITY;
+}
+
+// A ledger in a different format is moved aside rather than overwritten, it
+// holds the only record of the battery's history.
+Result initCycleLedger(const char* ledgerPath) {
+    Result res;
+    res.status = 0;
+
+    ledgerFd = open(ledgerPath, O_CREAT | O_RDWR, RW_PERMISSION);
+    if (ledgerFd == -1) {
+        snprintf(res.message, sizeof(res.message), "Failed to open cycle ledger: %s", strerror(errno));
+        res.status = -1;
+        return res;
+    }
+
+    struct stat ledgerStat;
+    if (fstat(ledgerFd, &ledgerStat) == -1) {
+        snprintf(res.message, sizeof(res.message), "Failed to stat cycle ledger: %s", strerror(errno));
+        res.status = -1;
+        disposeCycleLedger();
+        return res;
+    }
+
+    // A file shorter than the header was cut off while it was created and
+    // holds no records, it simply starts over.
+    if (ledgerStat.st_size >= (off_t)sizeof(LedgerHeader)) {
+        if (pread(ledgerFd, &header, sizeof(header), 0) != sizeof(header)) {
+            snprintf(res.message, sizeof(res.message), "Failed to read cycle ledger: %s", strerror(errno));
+            res.status = -1;
+            disposeCycleLedger();
+            return res;
+        }
+
+        if (layoutMatches()) {
+            int recoverRes = recoverRecordCount(ledgerStat.st_size);
+            if (recoverRes != 0) {
+                snprintf(res.message, sizeof(res.message), "Failed to recover cycle ledger: %s", strerror(recoverRes));
+                res.status = -1;
+                disposeCycleLedger();
+            }
+            return res;
+        }
+
+        char backupPath[PATH_MAX];
+        snprintf(backupPath, sizeof(backupPath), "%s.%ld.bak", ledgerPath, (long)time(NULL));
+        disposeCycleLedger();
+
+        if (rename(ledgerPath, backupPath) == -1) {
+            snprintf(res.message, sizeof(res.message), "Failed to move aside unreadable cycle ledger: %s", strerror(errno));
+            res.status = -1;
+            return res;
+        }
+        LOG_ERROR("Cycle ledger has a different format, moved it to %s", backupPath);
+
+        ledgerFd = open(ledgerPath, O_CREAT | O_EXCL | O_RDWR, RW_PERMISSION);
+        if (ledgerFd == -1) {
+            snprintf(res.message, sizeof(res.message), "Failed to create cycle ledger: %s", strerror(errno));
+            res.status = -1;
+            return res;
+        }
+    }
+
+    resetHeader();
+    int writeRes = writeHeader();
+    if (writeRes != 0) {
+        snprintf(res.message, sizeof(res.message), "Failed to create cycle ledger: %s", strerror(writeRes));
+        res.status = -1;
+        disposeCycleLedger();
+    }
+
+    return res;
+}
+
+float getLearnedCapacity() {
+    return ledgerFd != -1 && layoutMatches() ? header.capacity : BATTERY_CAPACITY;
+}
+
+// The record lands before the header counts it, so a reader never sees a
+// count that points past the end of the file.
+int appendCycleRecord(const CycleRecord* record) {
+    if (ledgerFd == -1) {
+        return EBADF;
+    }
+
+    off_t offset = sizeof(LedgerHeader) + (off_t)header.recordCount * sizeof(CycleRecord);
+    if (pwrite(ledgerFd, record, sizeof(CycleRecord), offset) != sizeof(CycleRecord)) {
+        return errno;
+    }
+
+    header.recordCount++;
+    if (record->kind == CHARGING) {
+        header.chargeCycles++;
+    }
+    header.capacity = record->capacity;
+    header.ahIn += record->ahIn;
+    header.ahOut += record->ahOut;
+    header.whIn += record->whIn;
+    header.whOut += record->whOut;
+    header.fullCycles = header.ahOut / header.capacity;
+
+    return writeHeader();
+}
+
+void disposeCycleLedger() {
+    if (ledgerFd != -1) {
+        close(ledgerFd);
+        ledgerFd = -1;
+    }
+}
@@ -1,6 +1,7 @@
 #include "../include/electrical_data.h"
 
 int fd;
+static struct timespec lastReadStamp;
 
 void configureElectricalData(int p_fd) {
     fd = p_fd;
@@ -16,6 +17,7 @@ int tryReadRegister(uint8_t reg, int16_t* result) {
     if (read(fd, buf, 2) != 2) {
         return errno;
     }
+    clock_gettime(CLOCK_MONOTONIC_RAW, &lastReadStamp);
 
     uint16_t raw_value = (buf[0] << 8) | buf[1];
 
@@ -63,6 +65,15 @@ int tryReadCurrent(float* current) {
     return result;
 }
 
+// Stamps the reading with the moment its I2C transaction completed
+int tryReadCurrentAt(float* current, struct timespec* stamp) {
+    int result = tryReadCurrent(current);
+    if (result == 0) {
+        *stamp = lastReadStamp;
+    }
+    return result;
+}
+
 int tryReadVoltage(float* voltage) {
     int attempts = 0;
     int16_t voltageRaw;
@@ -80,22 +91,27 @@ int tryReadVoltage(float* voltage) {
     return result;
 }
 
-int dischargeCalibration(float* calibration) {
-    float busVoltage = 0;
-    int result = tryReadVoltage(&busVoltage);
-    *calibration = (busVoltage - MIN_VOLTAGE) / (MAX_VOLTAGE - MIN_VOLTAGE);
-    return result;
+int tryReadSnapshot(ElectricalSnapshot* snapshot) {
+    int result = tryReadPower(&snapshot->power);
+    if (result != 0) {
+        return result;
+    }
+    result = tryReadVoltage(&snapshot->voltage);
+    if (result != 0) {
+        return result;
+    }
+    return tryReadCurrentAt(&snapshot->current, &snapshot->stamp);
 }
 
-int chargeCalibration(float* calibration) {
-    float power = 0;
-    int result = tryReadPower(&power);
+float dischargeCalibration(float busVoltage) {
+    return (busVoltage - MIN_VOLTAGE) / (MAX_VOLTAGE - MIN_VOLTAGE);
+}
 
+float chargeCalibration(float power) {
     int powerInt = (int)power;
 
     if (powerInt > MAX_POWER)
         powerInt = MAX_POWER;
 
-    *calibration = 1 - (powerInt / MAX_POWER);
-    return result;
+    return 1 - (powerInt / MAX_POWER);
 }
\ No newline at end of file
@@ -0,0 +1,256 @@
+#include "../include/history_store.h"
+
+#define HISTORY_MAGIC 0x48495354
+#define HISTORY_VERSION 2
+#define HISTORY_READ_ATTEMPTS 100
+
+static const uint32_t resolutions[HISTORY_TIER_COUNT] = HISTORY_TIER_RESOLUTIONS;
+static const uint32_t lengths[HISTORY_TIER_COUNT] = HISTORY_TIER_LENGTHS;
+
+static HistoryHeader* header = NULL;
+static HistoryPoint* tierPoints[HISTORY_TIER_COUNT];
+static size_t mappedSize = 0;
+
+static size_t storeSize() {
+    size_t size = sizeof(HistoryHeader);
+    for (int i = 0; i < HISTORY_TIER_COUNT; i++) {
+        size += lengths[i] * sizeof(HistoryPoint);
+    }
+    return size;
+}
+
+static int layoutMatches() {
+    if (header->magic != HISTORY_MAGIC || header->version != HISTORY_VERSION || header->tierCount != HISTORY_TIER_COUNT) {
+        return 0;
+    }
+    for (int i = 0; i < HISTORY_TIER_COUNT; i++) {
+        if (header->tiers[i].resolution != resolutions[i] || header->tiers[i].length != lengths[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void resetStore() {
+    header->magic = HISTORY_MAGIC;
+    header->version = HISTORY_VERSION;
+    header->tierCount = HISTORY_TIER_COUNT;
+    atomic_store(&header->sequence, 0);
+    for (int i = 0; i < HISTORY_TIER_COUNT; i++) {
+        header->tiers[i].resolution = resolutions[i];
+        header->tiers[i].length = lengths[i];
+        header->tiers[i].newestBucket = -1;
+        for (uint32_t j = 0; j < lengths[i]; j++) {
+            tierPoints[i][j].bucket = -1;
+            tierPoints[i][j].previous = -1;
+            tierPoints[i][j].count = 0;
+        }
+    }
+}
+
+static void startRollup(HistoryRollup* rollup, float value) {
+    rollup->min = value;
+    rollup->max = value;
+    rollup->mean = value;
+}
+
+static void foldRollup(HistoryRollup* rollup, float value, uint32_t count) {
+    if (value < rollup->min)
+        rollup->min = value;
+    if (value > rollup->max)
+        rollup->max = value;
+    rollup->mean += (value - rollup->mean) / count;
+}
+
+static Result mapStore(const char* historyPath, int writable) {
+    Result res;
+    res.status = 0;
+
+    int historyFd = open(historyPath, writable ? O_CREAT | O_RDWR : O_RDONLY, RW_PERMISSION);
+    if (historyFd == -1) {
+        snprintf(res.message, sizeof(res.message), "Failed to open history store: %s", strerror(errno));
+        res.status = -1;
+        return res;
+    }
+
+    mappedSize = storeSize();
+    if (writable && ftruncate(historyFd, mappedSize) == -1) {
+        snprintf(res.message, sizeof(res.message), "Failed to size history store: %s", strerror(errno));
+        res.status = -1;
+        close(historyFd);
+        return res;
+    }
+
+    header = mmap(NULL, mappedSize, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, historyFd, 0);
+    close(historyFd);
+    if (header == MAP_FAILED) {
+        header = NULL;
+        snprintf(res.message, sizeof(res.message), "Failed to map history store: %s", strerror(errno));
+        res.status = -1;
+        return res;
+    }
+
+    HistoryPoint* points = (HistoryPoint*)(header + 1);
+    for (int i = 0; i < HISTORY_TIER_COUNT; i++) {
+        tierPoints[i] = points;
+        points += lengths[i];
+    }
+
+    return res;
+}
+
+Result initHistoryStore(const char* historyPath) {
+    Result res = mapStore(historyPath, 1);
+    if (res.status == 0 && !layoutMatches()) {
+        resetStore();
+    }
+    return res;
+}
+
+// Read-only mapping for processes other than the daemon
+Result attachHistoryStore(const char* historyPath) {
+    Result res = mapStore(historyPath, 0);
+    if (res.status == 0 && !layoutMatches()) {
+        snprintf(res.message, sizeof(res.message), "History store layout does not match this build");
+        res.status = -1;
+        disposeHistoryStore();
+    }
+    return res;
+}
+
+static void recordTier(int tierIndex, int64_t bucket, float soc, float voltage, float current, float power) {
+    HistoryTier* tier = &header->tiers[tierIndex];
+    HistoryPoint* point = &tierPoints[tierIndex][bucket % tier->length];
+
+    if (bucket > tier->newestBucket) {
+        // Mark the skipped buckets so a query landing in the gap finds the
+        // previous occupied point straight away. Bounded by the tier length.
+        int64_t gap = tier->newestBucket + 1;
+        if (gap < bucket - tier->length + 1)
+            gap = bucket - tier->length + 1;
+        for (; gap < bucket; gap++) {
+            HistoryPoint* skipped = &tierPoints[tierIndex][gap % tier->length];
+            skipped->bucket = gap;
+            skipped->previous = tier->newestBucket;
+            skipped->count = 0;
+        }
+
+        point->bucket = bucket;
+        point->previous = tier->newestBucket;
+        point->count = 1;
+        startRollup(&point->soc, soc);
+        startRollup(&point->voltage, voltage);
+        startRollup(&point->current, current);
+        startRollup(&point->power, power);
+        tier->newestBucket = bucket;
+        return;
+    }
+
+    // Late samples only fold into a bucket that still exists, a new one here
+    // would break the chain of previous links.
+    if (point->bucket != bucket || point->count == 0) {
+        return;
+    }
+
+    point->count++;
+    foldRollup(&point->soc, soc, point->count);
+    foldRollup(&point->voltage, voltage, point->count);
+    foldRollup(&point->current, current, point->count);
+    foldRollup(&point->power, power, point->count);
+}
+
+void recordHistory(time_t time, float soc, float voltage, float current, float power) {
+    if (header == NULL) {
+        return;
+    }
+
+    unsigned sequence = atomic_load_explicit(&header->sequence, memory_order_relaxed);
+    atomic_store_explicit(&header->sequence, sequence + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    for (int i = 0; i < HISTORY_TIER_COUNT; i++) {
+        recordTier(i, (int64_t)time / resolutions[i], soc, voltage, current, power);
+    }
+
+    atomic_store_explicit(&header->sequence, sequence + 2, memory_order_release);
+}
+
+// Walks back from `to` along the previous links, so only occupied buckets
+// are visited. Returns at most maxPoints, the newest ones, oldest first.
+static size_t walkTier(int tierIndex, time_t from, time_t to, HistoryPoint* points, size_t maxPoints) {
+    HistoryTier* tier = &header->tiers[tierIndex];
+    int64_t first = (int64_t)from / tier->resolution;
+    int64_t oldest = tier->newestBucket - tier->length + 1;
+    int64_t cursor = (int64_t)to / tier->resolution;
+
+    if (cursor > tier->newestBucket)
+        cursor = tier->newestBucket;
+
+    size_t count = 0;
+    while (cursor >= first && cursor >= oldest && cursor >= 0 && count < maxPoints) {
+        HistoryPoint* point = &tierPoints[tierIndex][cursor % tier->length];
+        if (point->bucket != cursor) {
+            break;
+        }
+        if (point->count > 0) {
+            points[count++] = *point;
+        }
+        cursor = point->previous;
+    }
+
+    for (size_t i = 0; i < count / 2; i++) {
+        HistoryPoint swap = points[i];
+        points[i] = points[count - 1 - i];
+        points[count - 1 - i] = swap;
+    }
+
+    return count;
+}
+
+// Answers from the finest tier that still holds `from` and reports that
+// tier's resolution, the points' bucket times it is their start time.
+size_t queryHistory(time_t from, time_t to, HistoryPoint* points, size_t maxPoints, uint32_t* resolution) {
+    if (header == NULL || to < from) {
+        return 0;
+    }
+
+    for (int attempt = 0; attempt < HISTORY_READ_ATTEMPTS; attempt++) {
+        unsigned before = atomic_load_explicit(&header->sequence, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+
+        int tierIndex = HISTORY_TIER_COUNT - 1;
+        for (int i = 0; i < HISTORY_TIER_COUNT; i++) {
+            HistoryTier* tier = &header->tiers[i];
+            if ((int64_t)from / tier->resolution > tier->newestBucket - tier->length) {
+                tierIndex = i;
+                break;
+            }
+        }
+
+        size_t count = walkTier(tierIndex, from, to, points, maxPoints);
+
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&header->sequence, memory_order_relaxed) == before) {
+            *resolution = resolutions[tierIndex];
+            return count;
+        }
+    }
+
+    return 0;
+}
+
+int syncHistoryStore() {
+    if (header != NULL && msync(header, mappedSize, MS_SYNC) == -1) {
+        return errno;
+    }
+    return 0;
+}
+
+void disposeHistoryStore() {
+    if (header != NULL) {
+        munmap(header, mappedSize);
+        header = NULL;
+    }
+}
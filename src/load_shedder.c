@@ -0,0 +1,319 @@
+#include "../include/load_shedder.h"
+
+#define STAGE_COUNT (sizeof(stages) / sizeof(stages[0]))
+#define LOAD_SHED_STATE_MAGIC 0x4c534844
+
+static ShedStage stages[] = {
+    { .name = "governor", .action = SHED_GOVERNOR,
+      .socThreshold = LOAD_SHED_GOVERNOR_SOC, .powerThreshold = LOAD_SHED_GOVERNOR_POWER },
+    { .name = "frequency-cap", .action = SHED_MAX_FREQ,
+      .socThreshold = LOAD_SHED_MAX_FREQ_SOC, .powerThreshold = LOAD_SHED_MAX_FREQ_POWER },
+    { .name = "units", .action = SHED_UNITS,
+      .socThreshold = LOAD_SHED_UNITS_SOC, .powerThreshold = LOAD_SHED_UNITS_POWER },
+};
+
+static LoadShedState* state = NULL;
+static float recentPower = 0;
+static char onBattery = 0;
+
+static int readSysfs(const char* directory, const char* name, char* value, size_t size) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE* file = fopen(path, "r");
+    if (file == NULL) {
+        return errno;
+    }
+    if (fgets(value, size, file) == NULL) {
+        fclose(file);
+        return EIO;
+    }
+    fclose(file);
+
+    value[strcspn(value, "\n")] = '\0';
+    return 0;
+}
+
+static int writeSysfs(const char* directory, const char* name, const char* value) {
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", directory, name);
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL) {
+        return errno;
+    }
+    int writeRes = fputs(value, file) < 0 ? EIO : 0;
+    if (fclose(file) != 0 && writeRes == 0) {
+        writeRes = errno;
+    }
+    return writeRes;
+}
+
+// Executes LOAD_SHED_UNIT_COMMAND directly, no shell and no sudo. The child
+// drops the daemon's ambient capabilities, polkit decides whether its user may
+// start and stop the units. --no-block only queues the jobs, so the I/O thread
+// is not held up while the units take their time to stop.
+static int runUnitCommand(const char* verb) {
+    char units[] = LOAD_SHED_UNITS;
+    char* argv[LOAD_SHED_MAX_UNITS + 4];
+    int argc = 0;
+
+    argv[argc++] = LOAD_SHED_UNIT_COMMAND;
+    argv[argc++] = "--no-block";
+    argv[argc++] = (char*)verb;
+    char* saveptr;
+    for (char* unit = strtok_r(units, " ", &saveptr); unit != NULL && argc < LOAD_SHED_MAX_UNITS + 3;
+         unit = strtok_r(NULL, " ", &saveptr)) {
+        argv[argc++] = unit;
+    }
+    argv[argc] = NULL;
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        return errno;
+    }
+    if (pid == 0) {
+        prctl(PR_CAP_AMBIENT, PR_CAP_AMBIENT_CLEAR_ALL, 0, 0, 0);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) == -1) {
+        if (errno != EINTR) {
+            return errno;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : ECHILD;
+}
+
+static int applyStage(ShedStage* stage) {
+    int result = 0;
+
+    switch (stage->action) {
+        case SHED_GOVERNOR:
+            for (uint32_t i = 0; i < state->policyCount; i++) {
+                int readRes = readSysfs(state->policies[i].path, "scaling_governor", state->policies[i].governor, sizeof(state->policies[i].governor));
+                int writeRes = readRes != 0 ? readRes : writeSysfs(state->policies[i].path, "scaling_governor", LOAD_SHED_GOVERNOR);
+                if (writeRes != 0)
+                    result = writeRes;
+            }
+            break;
+        case SHED_MAX_FREQ:
+            for (uint32_t i = 0; i < state->policyCount; i++) {
+                int readRes = readSysfs(state->policies[i].path, "scaling_max_freq", state->policies[i].maxFreq, sizeof(state->policies[i].maxFreq));
+                int writeRes = readRes != 0 ? readRes : writeSysfs(state->policies[i].path, "scaling_max_freq", LOAD_SHED_MAX_FREQ);
+                if (writeRes != 0)
+                    result = writeRes;
+            }
+            break;
+        default: //SHED_UNITS
+            if (strlen(LOAD_SHED_UNITS) > 0) {
+                result = runUnitCommand("stop");
+            }
+            break;
+    }
+
+    return result;
+}
+
+static int restoreStage(ShedStage* stage) {
+    int result = 0;
+
+    switch (stage->action) {
+        case SHED_GOVERNOR:
+            for (uint32_t i = 0; i < state->policyCount; i++) {
+                int writeRes = state->policies[i].governor[0] == '\0' ? 0 : writeSysfs(state->policies[i].path, "scaling_governor", state->policies[i].governor);
+                if (writeRes != 0)
+                    result = writeRes;
+            }
+            break;
+        case SHED_MAX_FREQ:
+            for (uint32_t i = 0; i < state->policyCount; i++) {
+                int writeRes = state->policies[i].maxFreq[0] == '\0' ? 0 : writeSysfs(state->policies[i].path, "scaling_max_freq", state->policies[i].maxFreq);
+                if (writeRes != 0)
+                    result = writeRes;
+            }
+            break;
+        default: //SHED_UNITS
+            if (strlen(LOAD_SHED_UNITS) > 0) {
+                result = runUnitCommand("start");
+            }
+            break;
+    }
+
+    return result;
+}
+
+static void scanPolicies(const char* sysfsRoot) {
+    char cpufreqPath[PATH_MAX - NAME_MAX - 1];
+    snprintf(cpufreqPath, sizeof(cpufreqPath), "%s/devices/system/cpu/cpufreq", sysfsRoot);
+
+    state->policyCount = 0;
+
+    DIR* directory = opendir(cpufreqPath);
+    if (directory == NULL) {
+        LOG_ERROR("No cpufreq policies to shed load with: %s", strerror(errno));
+        return;
+    }
+
+    struct dirent* entry;
+    while ((entry = readdir(directory)) != NULL && state->policyCount < LOAD_SHED_MAX_POLICIES) {
+        if (strncmp(entry->d_name, "policy", 6) != 0) {
+            continue;
+        }
+        CpufreqPolicy* policy = &state->policies[state->policyCount];
+        snprintf(policy->path, sizeof(policy->path), "%s/%s", cpufreqPath, entry->d_name);
+        policy->governor[0] = '\0';
+        policy->maxFreq[0] = '\0';
+        state->policyCount++;
+    }
+    closedir(directory);
+}
+
+// sysfsRoot can point at a fake tree laid out like /sys. Stages a previous run
+// left applied are restored from the saved values before the policies are scanned.
+Result initLoadShedder(const char* sysfsRoot, const char* statePath) {
+    Result res;
+    res.status = 0;
+
+    recentPower = 0;
+    onBattery = 0;
+
+    int stateFd = open(statePath, O_CREAT | O_RDWR, RW_PERMISSION);
+    if (stateFd == -1) {
+        snprintf(res.message, sizeof(res.message), "Failed to open load shedding state: %s", strerror(errno));
+        res.status = -1;
+        return res;
+    }
+
+    if (ftruncate(stateFd, sizeof(LoadShedState)) == -1) {
+        snprintf(res.message, sizeof(res.message), "Failed to size load shedding state: %s", strerror(errno));
+        res.status = -1;
+        close(stateFd);
+        return res;
+    }
+
+    state = mmap(NULL, sizeof(LoadShedState), PROT_READ | PROT_WRITE, MAP_SHARED, stateFd, 0);
+    close(stateFd);
+    if (state == MAP_FAILED) {
+        state = NULL;
+        snprintf(res.message, sizeof(res.message), "Failed to map load shedding state: %s", strerror(errno));
+        res.status = -1;
+        return res;
+    }
+
+    if (state->magic != LOAD_SHED_STATE_MAGIC || state->appliedStages > STAGE_COUNT ||
+        state->policyCount > LOAD_SHED_MAX_POLICIES) {
+        state->magic = LOAD_SHED_STATE_MAGIC;
+        state->appliedStages = 0;
+        state->policyCount = 0;
+    }
+
+    if (state->appliedStages > 0) {
+        #if INFO_LOGGER_ENABLED
+            LOG_INFO("Restoring %u load shedding stages left applied by the previous run", state->appliedStages);
+        #endif
+        restoreLoadShedding();
+    }
+
+    scanPolicies(sysfsRoot);
+
+    return res;
+}
+
+// Engages one stage at a time while discharging, and only once the previous
+// stage has settled, so each stage's power reduction can be measured on its own.
+void evaluateLoadShedding(BatteryState batteryState, float soc, float power, time_t time) {
+    if (state == NULL || isShutdownInProgress()) { // Nothing to gain, and nothing may delay the shutdown
+        return;
+    }
+
+    onBattery = batteryState == DISCHARGING || batteryState == DEPLETED;
+    recentPower = recentPower == 0 ? power : recentPower + LOAD_SHED_POWER_SMOOTHING * (power - recentPower);
+
+    if (batteryState == CHARGING || batteryState == ACPOWER) {
+        restoreLoadShedding();
+        return;
+    }
+    if (batteryState != DISCHARGING) {
+        return;
+    }
+
+    if (state->appliedStages > 0) {
+        ShedStage* last = &stages[state->appliedStages - 1];
+        if (!last->measured) {
+            if (time - last->appliedAt < LOAD_SHED_SETTLE_TIME) {
+                return;
+            }
+            last->measured = 1;
+            #if INFO_LOGGER_ENABLED
+                LOG_INFO("Load shedding stage %s: %.3fW -> %.3fW (%.1f%%)", last->name, last->powerBefore, recentPower,
+                         last->powerBefore > 0 ? (last->powerBefore - recentPower) / last->powerBefore * 100 : 0);
+            #endif
+        }
+    }
+
+    if (state->appliedStages == STAGE_COUNT) {
+        return;
+    }
+
+    ShedStage* next = &stages[state->appliedStages];
+    if (soc > next->socThreshold && recentPower < next->powerThreshold) {
+        return;
+    }
+
+    next->powerBefore = recentPower;
+    next->appliedAt = time;
+    next->measured = 0;
+    state->appliedStages++;
+
+    int applyRes = applyStage(next);
+    if (applyRes != 0) {
+        LOG_ERROR("Failed to apply load shedding stage %s: %s", next->name, strerror(applyRes));
+    }
+    #if INFO_LOGGER_ENABLED
+        LOG_INFO("Applied load shedding stage %s at SoC %.3f, %.3fW", next->name, soc, recentPower);
+    #endif
+}
+
+// A stage stays counted until it has been restored, so a restart halfway
+// through still finds it in the persisted state.
+void restoreLoadShedding() {
+    if (state == NULL) {
+        return;
+    }
+
+    while (state->appliedStages > 0) {
+        ShedStage* stage = &stages[state->appliedStages - 1];
+
+        int restoreRes = restoreStage(stage);
+        state->appliedStages--;
+        if (restoreRes != 0) {
+            LOG_ERROR("Failed to restore load shedding stage %s: %s", stage->name, strerror(restoreRes));
+        }
+        #if INFO_LOGGER_ENABLED
+            LOG_INFO("Restored load shedding stage %s", stage->name);
+        #endif
+    }
+}
+
+// Restores the stages when the daemon exits on external power. On battery, and
+// while a shutdown is under way, they stay applied so the draw stays low until
+// power is gone; initLoadShedder() puts them back on the next start.
+void releaseLoadShedding() {
+    if (onBattery || isShutdownInProgress()) {
+        #if INFO_LOGGER_ENABLED
+            LOG_INFO("Leaving load shedding applied on exit");
+        #endif
+        return;
+    }
+    restoreLoadShedding();
+}
+
+void disposeLoadShedder() {
+    if (state != NULL) {
+        munmap(state, sizeof(LoadShedState));
+        state = NULL;
+    }
+}
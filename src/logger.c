@@ -1,5 +1,8 @@
 #include "../include/logger.h"
 
+static FILE* file = NULL;
+static __thread LogDeferral deferral = NULL;
+
 int initLog(const char* filename) {
     file = fopen(filename, "a");
     if (!file) {
@@ -10,15 +13,10 @@ int initLog(const char* filename) {
     return 0;
 }
 
-void logMessage(int logLevel, const char* format, ...) {
-    va_list args;
-    va_start(args, format);    
-
-    time_t raw_time;
+static void writeEntry(int logLevel, time_t raw_time, const char* format, va_list args) {
     struct tm *time_info;
     char time_buffer[80];
 
-    time(&raw_time);
     time_info = localtime(&raw_time);
 
     strftime(time_buffer, sizeof(time_buffer), "%Y-%m-%d %H:%M:%S", time_info);
@@ -35,16 +33,51 @@ void logMessage(int logLevel, const char* format, ...) {
     }
 
     if (logLevel == LOG_ERROR_CODE) {
-        fprintf(stderr, format, args); 
+        va_list stderr_args;
+        va_copy(stderr_args, args);
+        vfprintf(stderr, format, stderr_args);
+        fprintf(stderr, "\n");
+        va_end(stderr_args);
     }
 
     vfprintf(file, format, args);
     fprintf(file, "\n");
     fflush(file); 
+}
+
+static void writeFormatted(int logLevel, time_t raw_time, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    writeEntry(logLevel, raw_time, format, args);
+    va_end(args);
+}
+
+void logMessage(int logLevel, const char* format, ...) {
+    va_list args;
+    va_start(args, format);    
+
+    time_t raw_time;
+    time(&raw_time);
+
+    if (deferral != NULL) {
+        char message[LOG_MESSAGE_SIZE];
+        vsnprintf(message, sizeof(message), format, args);
+        deferral(logLevel, raw_time, message);
+    } else {
+        writeEntry(logLevel, raw_time, format, args);
+    }
     
     va_end(args);
 }
 
+void setLogDeferral(LogDeferral handler) {
+    deferral = handler;
+}
+
+void writeLogMessage(int logLevel, time_t raw_time, const char* message) {
+    writeFormatted(logLevel, raw_time, "%s", message);
+}
+
 void disposeLogger() {
     fclose(file);
-}
\ No newline at end of file
+}
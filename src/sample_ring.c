@@ -0,0 +1,41 @@
+#include "../include/sample_ring.h"
+
+_Static_assert((SAMPLE_RING_SIZE & (SAMPLE_RING_SIZE - 1)) == 0, "SAMPLE_RING_SIZE must be a power of two");
+
+void initSampleRing(SampleRing* ring) {
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->overruns, 0);
+}
+
+// Drops the event and counts an overrun when the consumer has fallen behind
+int pushSampleEvent(SampleRing* ring, const SampleEvent* event) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail == SAMPLE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->overruns, 1, memory_order_relaxed);
+        return -1;
+    }
+
+    ring->slots[head & (SAMPLE_RING_SIZE - 1)] = *event;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 0;
+}
+
+int popSampleEvent(SampleRing* ring, SampleEvent* event) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (head == tail) {
+        return -1;
+    }
+
+    *event = ring->slots[tail & (SAMPLE_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 0;
+}
+
+unsigned long takeSampleOverruns(SampleRing* ring) {
+    return atomic_exchange_explicit(&ring->overruns, 0, memory_order_relaxed);
+}
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include "../include/sampler.h"
+#include "../include/battery_soc.h"
+
+static SampleRing ring;
+static pthread_t samplerThread;
+static atomic_int samplerRunning = 0;
+static float* socRef;
+
+static void deferLog(int logLevel, time_t raw_time, const char* message) {
+    SampleEvent event;
+    event.type = LOG_EVENT;
+    event.time = raw_time;
+    event.log.level = logLevel;
+    strncpy(event.log.text, message, sizeof(event.log.text) - 1);
+    event.log.text[sizeof(event.log.text) - 1] = '\0';
+    pushSampleEvent(&ring, &event);
+}
+
+void publishSample(BatteryState state, float current, float power, float voltage, double interval, float soc) {
+    SampleEvent event;
+    event.type = SAMPLE_EVENT;
+    time(&event.time);
+    event.sample.state = state;
+    event.sample.current = current;
+    event.sample.power = power;
+    event.sample.voltage = voltage;
+    event.sample.interval = interval;
+    event.sample.soc = soc;
+    pushSampleEvent(&ring, &event);
+}
+
+void requestShutdown(const char* reason, double availableTime) {
+    SampleEvent event;
+    event.type = SHUTDOWN_EVENT;
+    time(&event.time);
+    event.shutdown.reason = reason;
+    event.shutdown.availableTime = availableTime;
+    pushSampleEvent(&ring, &event);
+}
+
+int publishCycle(const CycleRecord* record) {
+    SampleEvent event;
+    event.type = CYCLE_EVENT;
+    time(&event.time);
+    event.cycle = *record;
+    return pushSampleEvent(&ring, &event);
+}
+
+// Everything that can block on the filesystem, the logger or the buzzer is
+// handed to the I/O thread, so the only blocking calls left here are I2C and
+// the wait for the next sample period.
+static void* runSampler(void* arg) {
+    (void)arg;
+    setLogDeferral(deferLog);
+
+    SocMachine machine;
+    initSocMachine(&machine, getLearnedCapacity());
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (atomic_load(&samplerRunning)) {
+        stepSocMachine(&machine, socRef);
+
+        next.tv_sec += SOC_REFRESH_DELAY;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec > next.tv_sec || (now.tv_sec == next.tv_sec && now.tv_nsec > next.tv_nsec)) {
+            next = now; // Fell behind, e.g. on I2C retries, start a fresh period
+        }
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR);
+    }
+
+    return NULL;
+}
+
+Result startSampler(float* soc_mem_ref) {
+    Result res;
+    res.status = 0;
+
+    socRef = soc_mem_ref;
+    initSampleRing(&ring);
+    atomic_store(&samplerRunning, 1);
+
+    #if SAMPLER_LOCK_MEMORY
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1) {
+            LOG_ERROR("Failed to lock sampler memory: %s", strerror(errno));
+        }
+    #endif
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, SAMPLER_STACK_SIZE);
+    #if SAMPLER_CPU >= 0
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(SAMPLER_CPU, &cpus);
+        pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+    #endif
+    #if SAMPLER_RT_PRIORITY > 0
+        struct sched_param param;
+        param.sched_priority = SAMPLER_RT_PRIORITY;
+        pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+        pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+        pthread_attr_setschedparam(&attr, &param);
+    #endif
+
+    int createRes = pthread_create(&samplerThread, &attr, runSampler, NULL);
+    #if SAMPLER_RT_PRIORITY > 0
+        if (createRes == EPERM) {
+            LOG_ERROR("Not permitted to use SCHED_FIFO, starting the sampler with default priority");
+            pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+            createRes = pthread_create(&samplerThread, &attr, runSampler, NULL);
+        }
+    #endif
+    pthread_attr_destroy(&attr);
+
+    if (createRes != 0) {
+        atomic_store(&samplerRunning, 0);
+        snprintf(res.message, sizeof(res.message), "Failed to start the sampling thread: %s", strerror(createRes));
+        res.status = -1;
+    }
+
+    return res;
+}
+
+// Returns once the current sample period is over, the events it published
+// are left in the ring for a final drainSampleEvents().
+void stopSampler() {
+    if (atomic_exchange(&samplerRunning, 0)) {
+        pthread_join(samplerThread, NULL);
+    }
+}
+
+void drainSampleEvents() {
+    SampleEvent event;
+
+    while (popSampleEvent(&ring, &event) == 0) {
+        switch (event.type) {
+            case SAMPLE_EVENT:
+                recordHistory(event.time, event.sample.soc, event.sample.voltage,
+                              event.sample.current, event.sample.power);
+                #if LOAD_SHED_ENABLED
+                    evaluateLoadShedding(event.sample.state, event.sample.soc, event.sample.power, event.time);
+                #endif
+                #if DATA_LOGGER_ENABLED
+                    logMessages(event.sample.current, event.sample.power, event.sample.voltage,
+                                event.sample.interval, event.sample.soc);
+                #endif
+                break;
+            case LOG_EVENT:
+                writeLogMessage(event.log.level, event.time, event.log.text);
+                break;
+            case SHUTDOWN_EVENT:
+                executeShutdown(event.shutdown.reason, event.shutdown.availableTime);
+                break;
+            case CYCLE_EVENT: {
+                int appendRes = appendCycleRecord(&event.cycle);
+                if (appendRes != 0) {
+                    LOG_ERROR("Failed to append cycle record: %s", strerror(appendRes));
+                }
+                break;
+            }
+        }
+    }
+
+    unsigned long overruns = takeSampleOverruns(&ring);
+    if (overruns > 0) {
+        LOG_ERROR("Sample ring overrun, %lu events dropped", overruns);
+    }
+}
@@ -0,0 +1,198 @@
+#include "../include/shutdown_planner.h"
+
+#define SHUTDOWN_STATE_MAGIC 0x55505344
+
+static ShutdownPlannerState* state = NULL;
+static ShutdownHook hooks[SHUTDOWN_MAX_HOOKS];
+static int hookCount = 0;
+static PoweroffHandler poweroff = NULL;
+static double dischargeCurrent = 0;
+// Written by the I/O thread, read by the sampling thread. The pipeline time is
+// published in milliseconds, a double is not written atomically on 32-bit ARM.
+static atomic_int inProgress = 0;
+static atomic_uint pipelineMillis = (unsigned)(SHUTDOWN_DEFAULT_PIPELINE_TIME * 1000);
+
+static double monotonicNow() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1000000000.0;
+}
+
+static double learn(double learned, double observed) {
+    return learned + SHUTDOWN_LEARNING_WEIGHT * (observed - learned);
+}
+
+// Asks init for an orderly poweroff (systemd maps SIGRTMIN+4 to poweroff.target),
+// falling back to the reboot syscall when init refuses the signal.
+static int initPoweroff() {
+    sync();
+    if (kill(1, SIGRTMIN + 4) == 0) {
+        return 0;
+    }
+    if (reboot(RB_POWER_OFF) == 0) {
+        return 0;
+    }
+    return errno;
+}
+
+Result initShutdownPlanner(const char* statePath) {
+    Result res;
+    res.status = 0;
+
+    int stateFd = open(statePath, O_CREAT | O_RDWR, RW_PERMISSION);
+    if (stateFd == -1) {
+        snprintf(res.message, sizeof(res.message), "Failed to open shutdown planner state: %s", strerror(errno));
+        res.status = -1;
+        return res;
+    }
+
+    if (ftruncate(stateFd, sizeof(ShutdownPlannerState)) == -1) {
+        snprintf(res.message, sizeof(res.message), "Failed to size shutdown planner state: %s", strerror(errno));
+        res.status = -1;
+        close(stateFd);
+        return res;
+    }
+
+    state = mmap(NULL, sizeof(ShutdownPlannerState), PROT_READ | PROT_WRITE, MAP_SHARED, stateFd, 0);
+    close(stateFd);
+    if (state == MAP_FAILED) {
+        state = NULL;
+        snprintf(res.message, sizeof(res.message), "Failed to map shutdown planner state: %s", strerror(errno));
+        res.status = -1;
+        return res;
+    }
+
+    if (state->magic != SHUTDOWN_STATE_MAGIC) {
+        state->magic = SHUTDOWN_STATE_MAGIC;
+        state->samples = 0;
+        state->pipelineTime = SHUTDOWN_DEFAULT_PIPELINE_TIME;
+    }
+
+    if (poweroff == NULL) {
+        poweroff = initPoweroff;
+    }
+
+    atomic_store(&pipelineMillis, (unsigned)(state->pipelineTime * 1000));
+
+    #if INFO_LOGGER_ENABLED
+        LOG_INFO("Learned shutdown pipeline time: %.1fs", state->pipelineTime);
+    #endif
+
+    return res;
+}
+
+int registerShutdownHook(const char* name, ShutdownHookFn fn, void* ctx, double budget, char essential) {
+    if (hookCount >= SHUTDOWN_MAX_HOOKS) {
+        return -1;
+    }
+
+    hooks[hookCount].name = name;
+    hooks[hookCount].fn = fn;
+    hooks[hookCount].ctx = ctx;
+    hooks[hookCount].budget = budget;
+    hooks[hookCount].essential = essential;
+    hookCount++;
+    return 0;
+}
+
+void setPoweroffHandler(PoweroffHandler handler) {
+    poweroff = handler;
+}
+
+void observeDischarge(float current) {
+    if (current >= 0) {
+        return;
+    }
+    if (dischargeCurrent == 0) {
+        dischargeCurrent = -current;
+    } else {
+        dischargeCurrent += SHUTDOWN_CURRENT_SMOOTHING * (-current - dischargeCurrent);
+    }
+}
+
+double predictRuntime(float soc, float capacity) {
+    if (dischargeCurrent <= 0) {
+        return INFINITY;
+    }
+    return (soc * capacity / dischargeCurrent) * 3600.0;
+}
+
+double requiredShutdownTime() {
+    double pipeline = atomic_load(&pipelineMillis) / 1000.0;
+    return pipeline + SHUTDOWN_TAIL_TIME + SHUTDOWN_SAFETY_MARGIN;
+}
+
+int shouldStartShutdown(float soc, float capacity) {
+    return !atomic_load(&inProgress) && predictRuntime(soc, capacity) <= requiredShutdownTime();
+}
+
+int isShutdownInProgress() {
+    return atomic_load(&inProgress);
+}
+
+int executeShutdown(const char* reason, double availableTime) {
+    if (atomic_exchange(&inProgress, 1)) {
+        return 0;
+    }
+
+    double start = monotonicNow();
+    double pipelineDeadline = start + availableTime - SHUTDOWN_TAIL_TIME - SHUTDOWN_SAFETY_MARGIN;
+    int skipped = 0;
+
+    #if INFO_LOGGER_ENABLED
+        LOG_INFO("Starting shutdown (%s), %.1fs available", reason, availableTime);
+    #else
+        (void)reason;
+    #endif
+
+    for (int i = 0; i < hookCount; i++) {
+        double hookStart = monotonicNow();
+        double remaining = pipelineDeadline - hookStart;
+
+        if (remaining < hooks[i].budget && !hooks[i].essential) {
+            LOG_ERROR("Skipping shutdown hook %s, %.1fs left of %.1fs budget", hooks[i].name, remaining, hooks[i].budget);
+            skipped++;
+            continue;
+        }
+
+        int hookRes = hooks[i].fn(hooks[i].ctx, hookStart + hooks[i].budget);
+        double elapsed = monotonicNow() - hookStart;
+
+        if (hookRes != 0) {
+            LOG_ERROR("Shutdown hook %s failed: %s", hooks[i].name, strerror(hookRes));
+        }
+        if (elapsed > hooks[i].budget) {
+            LOG_ERROR("Shutdown hook %s overran its budget: %.3fs of %.3fs", hooks[i].name, elapsed, hooks[i].budget);
+        }
+    }
+
+    double pipelineTime = monotonicNow() - start;
+    // A truncated pipeline says nothing about how long the full one takes
+    if (state != NULL && skipped == 0) {
+        state->pipelineTime = state->samples == 0 ? pipelineTime : learn(state->pipelineTime, pipelineTime);
+        state->samples++;
+        atomic_store(&pipelineMillis, (unsigned)(state->pipelineTime * 1000));
+        msync(state, sizeof(ShutdownPlannerState), MS_SYNC);
+    }
+
+    #if INFO_LOGGER_ENABLED
+        LOG_INFO("Shutdown pipeline finished in %.3fs, powering off", pipelineTime);
+    #endif
+
+    int poweroffRes = poweroff();
+    if (poweroffRes != 0) {
+        LOG_ERROR("Failed to power off: %s", strerror(poweroffRes));
+        atomic_store(&inProgress, 0);
+        return -1;
+    }
+
+    return 0;
+}
+
+void disposeShutdownPlanner() {
+    if (state != NULL) {
+        munmap(state, sizeof(ShutdownPlannerState));
+        state = NULL;
+    }
+    hookCount = 0;
+}
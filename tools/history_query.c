@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/history_store.h"
+#include "../globalConfig.h"
+
+#define MAX_QUERY_POINTS 4096
+
+// Prints the history between two unix times as CSV, reading HISTORY_PATH
+// while the daemon keeps writing it.
+int main(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <from> <to>\n", argv[0]);
+        return 1;
+    }
+
+    Result res = attachHistoryStore(HISTORY_PATH);
+    if (res.status != 0) {
+        fprintf(stderr, "%s\n", res.message);
+        return 1;
+    }
+
+    static HistoryPoint points[MAX_QUERY_POINTS];
+    uint32_t resolution = 0;
+    size_t count = queryHistory((time_t)strtoll(argv[1], NULL, 10), (time_t)strtoll(argv[2], NULL, 10),
+                                points, MAX_QUERY_POINTS, &resolution);
+
+    printf("start,samples,soc_min,soc_max,soc_mean,voltage_min,voltage_max,voltage_mean,current_min,current_max,current_mean,power_min,power_max,power_mean\n");
+    for (size_t i = 0; i < count; i++) {
+        HistoryPoint* point = &points[i];
+        printf("%lld,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f\n",
+               (long long)point->bucket * resolution, point->count,
+               point->soc.min, point->soc.max, point->soc.mean,
+               point->voltage.min, point->voltage.max, point->voltage.mean,
+               point->current.min, point->current.max, point->current.mean,
+               point->power.min, point->power.max, point->power.mean);
+    }
+
+    disposeHistoryStore();
+    return 0;
+}